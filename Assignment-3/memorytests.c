@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include "mymem.h"
+#include "memprof.h"
 
 /* performs a randomized test:
   totalSize == the total size of the memory pool, as passed to initmem2
@@ -36,6 +37,8 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
   }
 
   fprintf(log,"Running randomized tests: pool size == %d, fill ratio == %f, block size is from %d to %d, %d iterations\n",totalSize,fillRatio,minBlockSize,maxBlockSize,iterations);
+  if (mem_large_threshold() > 0)
+    fprintf(log,"\tBlocks of %zu bytes or more are mapped outside the pool\n",mem_large_threshold());
 
   fclose(log);
 
@@ -46,6 +49,7 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
     double sum_allocated = 0;
     int failed_allocations = 0;
     double sum_small = 0;
+    double sum_large = 0;
     struct timespec execstart, execend;
     int force_free = 0;
     int i;
@@ -60,7 +64,8 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
       if ( (i % 10000)==0 )
 	    srand ( time(NULL) );
 
-      if (!force_free && (mem_free() > (totalSize * (1-fillRatio))))
+      /* large blocks count towards the fill ratio even though they are not in the pool */
+      if (!force_free && ((mem_free() - (int)mem_large_allocated()) > (totalSize * (1-fillRatio))))
       {
 	    int newBlockSize = (rand()%(maxBlockSize-minBlockSize+1))+minBlockSize;
 	    /* allocate */
@@ -96,6 +101,7 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
       sum_hole_size += (mem_free() / mem_holes());
       sum_allocated += mem_allocated();
       sum_small += mem_small_free(smallBlockSize);
+      sum_large += mem_large_allocated();
     }//for
 
     clock_gettime(CLOCK_REALTIME, &execend);
@@ -112,6 +118,8 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
     fprintf(log,"\tAverage largest free block: %f\n",sum_largest_free/iterations);
     fprintf(log,"\tAverage allocated bytes: %f\n",sum_allocated/iterations);
     fprintf(log,"\tAverage number of small blocks: %f\n",sum_small/iterations);
+    if (mem_large_threshold() > 0)
+      fprintf(log,"\tAverage large allocated bytes: %f\n",sum_large/iterations);
     fprintf(log,"\tFailed allocations: %d\n",failed_allocations);
     fclose(log);
   }
@@ -122,6 +130,9 @@ int do_stress_tests(int argc, char **argv)
 {
   int strategy = strategyFromString(*(argv+1));
 
+  if (argc > 2)
+    mem_set_large_threshold(atoi(argv[2])); /* mem -test <strategy> <large threshold> */
+
   unlink("tests.log");  // We want a new log file
 
   do_randomized_test(strategy,10000,0.25,1,1000,10000);
@@ -149,19 +160,72 @@ int do_stress_tests(int argc, char **argv)
   return 0; /* you nominally pass for surviving without segfaulting */
 }
 
+/* allocation sites for do_profile_test, separate functions so they show up as separate call sites */
+void *profile_small_block()
+{
+  return mymalloc((rand()%48)+16);
+}
+
+void *profile_big_block()
+{
+  return mymalloc((rand()%300)+200);
+}
+
+/* run the sampling heap profiler over a random alloc/free pattern and print the
+   folded-stack profile: mem -prof <strategy> [sample bytes] */
+int do_profile_test(int argc, char **argv)
+{
+  void * pointers[1000];
+  int storedPointers = 0;
+  int strategy = First;
+  long rate = 1024;
+  int i;
+
+  if (argc > 1 && strategyFromString(argv[1]) != NotSet)
+    strategy = strategyFromString(argv[1]);
+  if (argc > 2 && atol(argv[2]) > 0)
+    rate = atol(argv[2]);
+
+  initmem(strategy,200000);
+  memprof_start(rate);
+  srand(time(NULL));
+
+  for (i = 0; i < 100000; i++)
+  {
+    /* keep up to 1000 blocks live, one big block for every four small ones */
+    void * pointer = (rand()%5) ? profile_small_block() : profile_big_block();
+
+    if (pointer != NULL && storedPointers < 1000)
+      pointers[storedPointers++] = pointer;
+    else if (pointer != NULL)
+    {
+      int chosen = rand() % storedPointers;
+      myfree(pointers[chosen]);
+      pointers[chosen] = pointer;
+    }
+  }
+
+  printf("Live blocks: %d, %d bytes allocated; sampled profile (1 sample per %ld bytes):\n",storedPointers,mem_allocated(),rate);
+  memprof_dump(stdout);
+  memprof_stop();
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   if( argc < 2) {
-    printf("Usage: mem -test <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <strategy> [large threshold] | mem -prof <strategy> [sample bytes] | mem -try <arg1> <arg2> ... \n");
     exit(-1);
   }
   else if (!strcmp(argv[1],"-test"))
     return do_stress_tests(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-prof"))
+    return do_profile_test(argc-1,argv+1);
   else if (!strcmp(argv[1],"-try")) {
     try_mymem(argc-1,argv+1);
     return 0;
   } else {
-    printf("Usage: mem -test <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <strategy> [large threshold] | mem -prof <strategy> [sample bytes] | mem -try <arg1> <arg2> ... \n");
     exit(-1);
   }
 }
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include "memprof.h"
+
+/********************
+ * Sampling heap profiler for mymem.
+ *
+ * Instead of recording every block like print_memory, roughly one
+ * allocation per sample_bytes allocated bytes has its backtrace recorded.
+ * Samples stay "live" until the block is freed and are grouped by call
+ * site, so a dump shows which code paths are holding on to the pool.
+ *
+ * Dumps are in folded-stack format (one "root;...;leaf bytes" line per
+ * call site) and can be fed straight to flamegraph.pl or speedscope.
+ * All tables are fixed-size static arrays so the profiler never calls
+ * malloc itself and is safe to use from the preload library.
+ *
+ * The profiler does no locking of its own.  Multi-threaded callers
+ * (the preload library) take memprof_snapshot under their allocator lock
+ * and write it with memprof_dump_snapshot after releasing it, because
+ * symbolizing frames with dladdr takes the dynamic loader's lock.
+ ********************/
+
+#define MAX_DEPTH 32      //frames kept per backtrace
+#define MAX_SITES 1024    //call sites with live samples that can be tracked at once
+#define MAX_LIVE 16384    //sampled blocks that can be live at once, must be a power of 2
+#define SKIP_FRAMES 2     //memprof_record_alloc and mymalloc themselves
+
+#define SITE_EMPTY 0      //site slot never used, ends a probe
+#define SITE_FREED 1      //site slot released when its last live sample was freed
+
+struct sampleSite
+{
+  uint64_t hash;          // hash of the frames, or SITE_EMPTY / SITE_FREED
+  int depth;              // number of valid entries in frames
+  void *frames[MAX_DEPTH];// return addresses, innermost first
+  long live_count;        // sampled blocks from here that are still allocated
+  long live_bytes;        // estimated bytes those samples stand for
+};
+
+struct liveSample
+{
+  void *ptr;              // sampled block, NULL if this slot is unused
+  int site;               // index into sites
+  long weight;            // estimated bytes this sample stands for
+};
+
+static struct sampleSite sites[MAX_SITES];
+static struct sampleSite snapshot[MAX_SITES];//live sites copied out by memprof_snapshot
+static int snapshot_sites = 0;
+static long snapshot_dropped = 0;
+static struct liveSample live[MAX_LIVE];
+static int live_samples = 0;//number of used slots in live
+static long dropped = 0;    //estimated bytes of samples lost because a table was full
+
+static long sample_rate = 0;        //0 when the profiler is off
+static long bytes_until_sample = 0; //countdown to the next sample
+static uint64_t rng_state = 88172645463325252ULL;
+
+static volatile sig_atomic_t dump_requested = 0;
+
+/* xorshift64, good enough to keep sample points from lining up with allocation patterns */
+static uint64_t next_random()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Bytes until the next sample, exponentially distributed with mean rate
+ * so that every allocated byte has the same chance of being sampled.
+ */
+static long next_interval()
+{
+    double u = ((next_random() >> 11) + 1.0) / 9007199254740993.0;//uniform in (0, 1]
+    return 1 + (long)(-log(u) * sample_rate);
+}
+
+static unsigned int hash_ptr(void *ptr)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 32) & (MAX_LIVE - 1);
+}
+
+/* Find or create the site for a backtrace, returns -1 if the table is full.
+ * Sites are released again once they have no live samples (see release_site),
+ * so the limit is on call sites holding memory at the same time.
+ */
+static int find_site(void **frames, int depth)
+{
+    uint64_t hash = 14695981039346656037ULL;//FNV-1a over the frame addresses
+    int i, idx, reuse = -1;
+
+    for(i = 0; i < depth; i++) {
+        hash ^= (uint64_t)(uintptr_t)frames[i];
+        hash *= 1099511628211ULL;
+    }
+    if(hash <= SITE_FREED){ hash += 2; }//keep clear of the slot markers
+
+    idx = (int)(hash % MAX_SITES);
+    for(i = 0; i < MAX_SITES; i++) {
+        struct sampleSite *site = &sites[idx];
+        if(site->hash == SITE_EMPTY) {
+            break;//not in the table
+        }
+        if(site->hash == SITE_FREED) {
+            if(reuse < 0){ reuse = idx; }//first released slot on the probe, keep looking for a match
+        } else if(site->hash == hash && site->depth == depth &&
+                  !memcmp(site->frames, frames, depth * sizeof(void *))) {
+            return idx;
+        }
+        idx = (idx + 1) % MAX_SITES;
+    }
+
+    if(reuse < 0 && i == MAX_SITES){ return -1; }//table full
+    if(reuse >= 0){ idx = reuse; }
+
+    sites[idx].hash = hash;//claim the slot for this call site
+    sites[idx].depth = depth;
+    sites[idx].live_count = 0;
+    sites[idx].live_bytes = 0;
+    memcpy(sites[idx].frames, frames, depth * sizeof(void *));
+    return idx;
+}
+
+/* Give a site's slot back once nothing sampled from it is live.  Live samples
+ * refer to sites by index, so the slot is marked rather than shifted.
+ */
+static void release_site(int idx)
+{
+    if(sites[idx].live_count == 0) {
+        sites[idx].hash = SITE_FREED;
+    }
+}
+
+/* Turn sampling on, taking one sample per sample_bytes allocated on average.
+ * A rate <= 0 uses MEMPROF_DEFAULT_RATE.
+ */
+void memprof_start(long sample_bytes)
+{
+    void *frames[2];
+
+    backtrace(frames, 2);//the first call loads the unwinder, get that out of the way now
+    sample_rate = sample_bytes > 0 ? sample_bytes : MEMPROF_DEFAULT_RATE;
+    bytes_until_sample = next_interval();
+}
+
+/* Stop taking new samples; live samples are kept until freed or reset */
+void memprof_stop()
+{
+    sample_rate = 0;
+}
+
+/* Forget every sample, e.g. when initmem throws the whole pool away */
+void memprof_reset()
+{
+    memset(sites, 0, sizeof(sites));
+    memset(live, 0, sizeof(live));
+    live_samples = 0;
+    dropped = 0;
+}
+
+/* Called by mymalloc for every successful allocation */
+void memprof_record_alloc(void *ptr, size_t size)
+{
+    void *frames[MAX_DEPTH + SKIP_FRAMES];
+    int depth, idx;
+    unsigned int slot;
+    long weight;
+
+    if(sample_rate == 0){ return; }
+
+    bytes_until_sample -= size;
+    if(bytes_until_sample > 0){ return; }//fast path, not sampled
+    bytes_until_sample = next_interval();
+
+    depth = backtrace(frames, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    if(depth < 0){ depth = 0; }
+    //a block of this size is sampled with probability 1 - e^(-size/rate), scale it back up
+    weight = (long)(size / (1.0 - exp(-(double)size / sample_rate)));
+
+    //keep the live table at most half full, and don't claim a site for a sample that can't be stored
+    idx = live_samples < MAX_LIVE / 2 ? find_site(frames + SKIP_FRAMES, depth) : -1;
+    if(idx < 0) {
+        dropped += weight;
+        return;
+    }
+
+    slot = hash_ptr(ptr);
+    while(live[slot].ptr != NULL) {
+        slot = (slot + 1) & (MAX_LIVE - 1);
+    }
+    live[slot].ptr = ptr;
+    live[slot].site = idx;
+    live[slot].weight = weight;
+    live_samples++;
+
+    sites[idx].live_count++;
+    sites[idx].live_bytes += weight;
+}
+
+/* Called by myfree for every block it releases */
+void memprof_record_free(void *ptr)
+{
+    unsigned int slot, hole, home;
+
+    if(live_samples == 0){ return; }//fast path, nothing to look up
+
+    slot = hash_ptr(ptr);
+    while(live[slot].ptr != ptr) {
+        if(live[slot].ptr == NULL){ return; }//block was not sampled
+        slot = (slot + 1) & (MAX_LIVE - 1);
+    }
+
+    sites[live[slot].site].live_count--;
+    sites[live[slot].site].live_bytes -= live[slot].weight;
+    release_site(live[slot].site);
+    live_samples--;
+
+    //backward-shift deletion so lookups never need tombstones
+    hole = slot;
+    slot = (slot + 1) & (MAX_LIVE - 1);
+    while(live[slot].ptr != NULL) {
+        home = hash_ptr(live[slot].ptr);
+        //move the entry into the hole unless its home lies cyclically in (hole, slot]
+        if(((slot - home) & (MAX_LIVE - 1)) >= ((slot - hole) & (MAX_LIVE - 1))) {
+            live[hole] = live[slot];
+            hole = slot;
+        }
+        slot = (slot + 1) & (MAX_LIVE - 1);
+    }
+    live[hole].ptr = NULL;
+}
+
+/* Write one frame as a function name, module+offset, or raw address */
+static void print_frame(FILE *out, void *addr)
+{
+    Dl_info info;
+    const char *module;
+
+    if(!dladdr(addr, &info)) {
+        fprintf(out, "%p", addr);
+    } else if(info.dli_sname != NULL) {
+        fprintf(out, "%s", info.dli_sname);
+    } else if(info.dli_fname != NULL) {
+        module = strrchr(info.dli_fname, '/');
+        module = module != NULL ? module + 1 : info.dli_fname;
+        fprintf(out, "%s+0x%lx", module, (unsigned long)((char *)addr - (char *)info.dli_fbase));
+    } else {
+        fprintf(out, "%p", addr);
+    }
+}
+
+/* Copy the live call sites aside so they can be written later without holding
+ * the caller's allocator lock.
+ */
+void memprof_snapshot()
+{
+    int i;
+
+    snapshot_sites = 0;
+    for(i = 0; i < MAX_SITES; i++) {
+        if(sites[i].hash > SITE_FREED && sites[i].live_count > 0) {
+            snapshot[snapshot_sites++] = sites[i];
+        }
+    }
+    snapshot_dropped = dropped;
+}
+
+/* Write the last snapshot in folded-stack format, one line per call site:
+ * "outermost;...;innermost estimated_live_bytes".
+ * Returns the number of call sites written.
+ */
+int memprof_dump_snapshot(FILE *out)
+{
+    int i, j;
+
+    for(i = 0; i < snapshot_sites; i++) {
+        for(j = snapshot[i].depth - 1; j >= 0; j--) {
+            print_frame(out, snapshot[i].frames[j]);
+            if(j > 0){ fputc(';', out); }
+        }
+        fprintf(out, " %ld\n", snapshot[i].live_bytes);
+    }
+    if(snapshot_dropped > 0) {
+        fprintf(out, "memprof_dropped_samples %ld\n", snapshot_dropped);
+    }
+    fflush(out);
+    return snapshot_sites;
+}
+
+/* memprof_dump_snapshot to a file, returns -1 if it cannot be opened */
+int memprof_dump_snapshot_file(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    int count;
+
+    if(out == NULL){ return -1; }
+    count = memprof_dump_snapshot(out);
+    fclose(out);
+    return count;
+}
+
+/* Snapshot and write in one go, for single-threaded callers like the mem driver */
+int memprof_dump(FILE *out)
+{
+    memprof_snapshot();
+    return memprof_dump_snapshot(out);
+}
+
+/* Signal handlers may not touch stdio, so only note the request;
+ * the owner polls memprof_dump_requested and writes the dump.
+ */
+static void dump_handler(int sig)
+{
+    dump_requested = 1;
+}
+
+/* Returns 1 (and clears the request) if the dump signal arrived since the last call */
+int memprof_dump_requested()
+{
+    if(!dump_requested){ return 0; }
+    dump_requested = 0;
+    return 1;
+}
+
+/* Ask for a dump whenever sig is delivered.  A handler the program already
+ * installed is left alone; returns -1 in that case, 0 otherwise.
+ */
+int memprof_dump_on_signal(int sig)
+{
+    struct sigaction action, old;
+
+    if(sigaction(sig, NULL, &old) != 0){ return -1; }
+    if(old.sa_handler != SIG_DFL || (old.sa_flags & SA_SIGINFO)) {
+        fprintf(stderr, "memprof: signal %d already has a handler, not installing the dump handler\n", sig);
+        return -1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    return sigaction(sig, &action, NULL);
+}
@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#define MEMPROF_DEFAULT_RATE (512 * 1024) //average bytes allocated between two samples
+
+void memprof_start(long sample_bytes);
+void memprof_stop();
+void memprof_reset();
+void memprof_record_alloc(void *ptr, size_t size);
+void memprof_record_free(void *ptr);
+void memprof_snapshot();
+int memprof_dump_snapshot(FILE *out);
+int memprof_dump_snapshot_file(const char *path);
+int memprof_dump(FILE *out);
+int memprof_dump_on_signal(int sig);
+int memprof_dump_requested();
@@ -3,8 +3,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include "mymem.h"
+#include "memprof.h"
 #include <time.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /********************
  * Joseph Krambeer
@@ -27,6 +30,20 @@ struct memoryList
   void *ptr;           // location of block in memory pool.
 };
 
+/* Allocations at or above the large threshold get their own mmap
+ * mapping instead of a block in the pool, and are tracked here.
+ */
+struct largeBlock
+{
+  // doubly-linked list
+  struct largeBlock *last;
+  struct largeBlock *next;
+
+  size_t size;         // How many bytes were requested?
+  size_t mapped;       // How many bytes were mapped (whole pages)?
+  void *ptr;           // location of the mapping.
+};
+
 strategies myStrategy = NotSet;    // Current strategy
 
 
@@ -36,7 +53,22 @@ void *myMemory = NULL;//actual memory pool
 static struct memoryList *head;//start of linked list
 static struct memoryList *next;//used to indicate link to start next stategy at
 
+static struct largeBlock *largeHead = NULL;//start of list of large allocations
+static size_t largeThreshold = 0;          //requests this big bypass the pool, 0 to disable
+
+static struct largeBlock **largeTable = NULL;//large blocks indexed by address, open addressing
+static size_t largeTableSize = 0;            //slots in largeTable, a power of 2
+static int largeCount = 0;                   //live large allocations
+static size_t largeBytes = 0;                //bytes requested by them
+
+/* Whether ptr lies inside the pool; large mappings never do */
+static int in_pool(void *ptr)
+{
+    return (char *)ptr >= (char *)myMemory && (char *)ptr < (char *)myMemory + mySize;
+}
+
 void split_block(struct memoryList *trav, int req);
+void *large_alloc(size_t requested);
 
 
 /* initmem must be called prior to mymalloc and myfree.
@@ -57,6 +89,8 @@ void initmem(strategies strategy, size_t sz)
 {
     struct memoryList *current = head;
     struct memoryList *temp;
+    struct largeBlock *large = largeHead;
+    struct largeBlock *largeTemp;
 	myStrategy = strategy;
 
 	/* all implementations will need an actual block of memory to use */
@@ -74,7 +108,25 @@ void initmem(strategies strategy, size_t sz)
         current = temp;      //update the current element
     }
 
+    /* Unmap large allocations, they belong to the old pool's owner too */
+    while(large != NULL){
+        largeTemp = large->next;
+        munmap(large->ptr, large->mapped);
+        free(large);
+        large = largeTemp;
+    }
+    largeHead = NULL;
+    free(largeTable);
+    largeTable = NULL;
+    largeTableSize = 0;
+    largeCount = 0;
+    largeBytes = 0;
+
 	myMemory = malloc(sz);//initialize memory
+	if (myMemory == NULL){
+		mySize = sz = 0;  //no pool, so there is nothing for mymalloc to hand out
+	}
+	memprof_reset();      //samples of the old pool are meaningless now
 
 	/* Initialize memory management structure. */
     head = malloc(sizeof(struct memoryList));
@@ -101,6 +153,13 @@ void *mymalloc(size_t requested)
     struct memoryList *current = head;
     struct memoryList *usedBlock = NULL;
 
+    //large requests get their own mapping so they don't carve up the pool
+    if(largeThreshold > 0 && requested >= largeThreshold) {
+        new_mem = large_alloc(requested);
+        if(new_mem != NULL){ memprof_record_alloc(new_mem, requested); }
+        return new_mem;
+    }
+
 	switch (myStrategy)
     {
 	  case NotSet:
@@ -182,6 +241,7 @@ void *mymalloc(size_t requested)
         split_block(usedBlock, requested);//split memory
         new_mem = usedBlock->ptr;         //set return pointer to newly allocated memory
         next = usedBlock;                 //update next pointer
+        memprof_record_alloc(new_mem, requested);//let the profiler decide whether to sample
     }
 	return new_mem;
 }//myalloc
@@ -193,6 +253,12 @@ void myfree(void* block)
     struct memoryList *temp = head;
     struct memoryList *memBlock = NULL;
 
+    //anything outside the pool can only be a large allocation
+    if(!in_pool(block)) {
+        mem_free_large(block);
+        return;
+    }
+
     //try to find an allocated block with same pointer as passed pointer
 	while(temp != NULL) {
         if(temp->alloc && (temp->ptr == block)) {
@@ -204,6 +270,7 @@ void myfree(void* block)
 
     if(memBlock == NULL){ return; }//if no blocks match, no block can be free'd
     memBlock->alloc = 0;//mark memory as free
+    memprof_record_free(block);//drop the sample if this block had one
 
     //merge with unallocated block after freed block, after block merged with current block
     if(memBlock->next != NULL && !(memBlock->next->alloc)) {
@@ -318,6 +385,7 @@ int mem_small_free(int size)
 char mem_is_alloc(void *ptr)
 {
     struct memoryList *current = head;
+    struct largeBlock *large;
 	uintptr_t address = (uintptr_t)ptr;//cast ptr to unsigned int for comparison
 	uintptr_t start, end;//used to indicated start/end of mem blocks
 
@@ -329,9 +397,199 @@ char mem_is_alloc(void *ptr)
 		}
         current = current->next;
 	}
+	for(large = largeHead; large != NULL; large = large->next) {
+		start = (uintptr_t) large->ptr;
+		end = (uintptr_t) large->ptr+(large->size)-1;
+		if(address >= start && address <= end) {
+			return 1;//the pointer is within a large allocation
+		}
+	}
 	return 0;//if the pointer isn't within the bounds of any allocated memory space, return false
 }//mem_is_alloc
 
+/* Size of the pool block starting at ptr, or 0 if ptr is not the start of one */
+int mem_block_size(void *ptr)
+{
+    struct memoryList *current = head;
+
+    if(!in_pool(ptr)){ return 0; }//large allocations are sized by mem_large_size
+
+    while(current != NULL) {
+        if(current->alloc && (current->ptr == ptr)) {
+            return current->size;//found the block mymalloc handed out for this pointer
+        }
+        current = current->next;
+    }
+    return 0;
+}//mem_block_size
+
+/****** Large allocations ******
+ * Requests of at least the large threshold never touch the pool's list.
+ * Each gets its own anonymous mapping, so freeing one returns the memory
+ * to the system right away and leaves no hole behind.
+ */
+
+/* Set the large threshold in bytes; 0 (the default) sends everything to the pool.
+ * The setting survives initmem.
+ */
+void mem_set_large_threshold(size_t threshold)
+{
+    largeThreshold = threshold;
+}
+
+size_t mem_large_threshold()
+{
+    return largeThreshold;
+}
+
+static size_t large_hash(void *ptr)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (largeTableSize - 1);
+}
+
+/* Slot in largeTable holding the block that starts at ptr, or -1 */
+static long large_find(void *ptr)
+{
+    size_t slot;
+
+    if(largeCount == 0){ return -1; }
+    for(slot = large_hash(ptr); largeTable[slot] != NULL; slot = (slot + 1) & (largeTableSize - 1)) {
+        if(largeTable[slot]->ptr == ptr) {
+            return (long)slot;
+        }
+    }
+    return -1;
+}
+
+/* Put a block in largeTable, doubling the table once it is half full.
+ * Returns 0 if the table could not grow.
+ */
+static int large_index(struct largeBlock *large)
+{
+    struct largeBlock **oldTable = largeTable;
+    size_t oldSize = largeTableSize;
+    size_t i, slot;
+
+    if((size_t)(largeCount + 1) * 2 > largeTableSize) {
+        largeTableSize = oldSize ? oldSize * 2 : 64;
+        largeTable = calloc(largeTableSize, sizeof(struct largeBlock *));
+        if(largeTable == NULL) {
+            largeTable = oldTable;//keep the old index
+            largeTableSize = oldSize;
+            return 0;
+        }
+        for(i = 0; i < oldSize; i++) {//rehash everything into the bigger table
+            if(oldTable[i] == NULL){ continue; }
+            for(slot = large_hash(oldTable[i]->ptr); largeTable[slot] != NULL; slot = (slot + 1) & (largeTableSize - 1));
+            largeTable[slot] = oldTable[i];
+        }
+        free(oldTable);
+    }
+
+    for(slot = large_hash(large->ptr); largeTable[slot] != NULL; slot = (slot + 1) & (largeTableSize - 1));
+    largeTable[slot] = large;
+    return 1;
+}
+
+/* Take a slot out of largeTable with backward-shift deletion, as memprof does for its live table */
+static void large_unindex(size_t slot)
+{
+    size_t hole = slot, home;
+
+    slot = (slot + 1) & (largeTableSize - 1);
+    while(largeTable[slot] != NULL) {
+        home = large_hash(largeTable[slot]->ptr);
+        //move the entry into the hole unless its home lies cyclically in (hole, slot]
+        if(((slot - home) & (largeTableSize - 1)) >= ((slot - hole) & (largeTableSize - 1))) {
+            largeTable[hole] = largeTable[slot];
+            hole = slot;
+        }
+        slot = (slot + 1) & (largeTableSize - 1);
+    }
+    largeTable[hole] = NULL;
+}
+
+/* Map a large allocation and add it to the large list and index, NULL on failure */
+void *large_alloc(size_t requested)
+{
+    struct largeBlock *large;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = (requested + page - 1) / page * page;//mappings come in whole pages
+    void *ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(ptr == MAP_FAILED){ return NULL; }
+
+    large = malloc(sizeof(struct largeBlock));
+    if(large == NULL) {
+        munmap(ptr, mapped);//no bookkeeping, no allocation
+        return NULL;
+    }
+    large->size = requested;
+    large->mapped = mapped;
+    large->ptr = ptr;
+    if(!large_index(large)) {
+        free(large);
+        munmap(ptr, mapped);
+        return NULL;
+    }
+
+    large->last = NULL;      //new blocks go on the front of the list
+    large->next = largeHead;
+    if(largeHead != NULL) {
+        largeHead->last = large;
+    }
+    largeHead = large;
+    largeCount++;
+    largeBytes += requested;
+    return ptr;
+}//large_alloc
+
+/* Unmap the large allocation starting at block.
+ * Returns 0 if block is not one, so callers can try their own allocator.
+ */
+int mem_free_large(void *block)
+{
+    struct largeBlock *large;
+    long slot = large_find(block);
+
+    if(slot < 0){ return 0; }
+    large = largeTable[slot];
+    large_unindex((size_t)slot);
+
+    //unlink from the list
+    if(large->last != NULL){ large->last->next = large->next; }
+    else { largeHead = large->next; }
+    if(large->next != NULL){ large->next->last = large->last; }
+
+    largeCount--;
+    largeBytes -= large->size;
+    munmap(large->ptr, large->mapped);
+    free(large);
+    memprof_record_free(block);//drop the sample if this block had one
+    return 1;
+}//mem_free_large
+
+/* Requested size of the large allocation starting at ptr, or 0 if ptr is not one */
+size_t mem_large_size(void *ptr)
+{
+    long slot = large_find(ptr);
+
+    return slot < 0 ? 0 : largeTable[slot]->size;
+}//mem_large_size
+
+/* Number of live large allocations */
+int mem_large_count()
+{
+    return largeCount;
+}//mem_large_count
+
+/* Bytes requested by live large allocations */
+size_t mem_large_allocated()
+{
+    return largeBytes;
+}//mem_large_allocated
+
 /*
  * Feel free to use these functions, but do not modify them.
  * The test code uses them, but you may ind them useful.
@@ -467,9 +725,20 @@ void print_memory()
  */
 void print_memory_status()
 {
-	printf("%d out of %d bytes allocated.\n",mem_allocated(),mem_total());
-	printf("%d bytes are free in %d holes; maximum allocatable block is %d bytes.\n",mem_free(),mem_holes(),mem_largest_free());
-	printf("Average hole size is %f.\n\n",((float)mem_free())/mem_holes());
+	fprint_memory_status(stdout);
+}
+
+/* Same as print_memory_status, but to any stream (the preload library reports on stderr). */
+void fprint_memory_status(FILE *out)
+{
+	fprintf(out,"%d out of %d bytes allocated.\n",mem_allocated(),mem_total());
+	fprintf(out,"%d bytes are free in %d holes; maximum allocatable block is %d bytes.\n",mem_free(),mem_holes(),mem_largest_free());
+	fprintf(out,"Average hole size is %f.\n",((float)mem_free())/mem_holes());
+	if(largeThreshold > 0) {
+		fprintf(out,"%zu bytes in %d large allocations (>= %zu bytes) outside the pool.\n",
+		        mem_large_allocated(),mem_large_count(),largeThreshold);
+	}
+	fprintf(out,"\n");
 }
 
 /* Use this function to see what happens when your malloc and free
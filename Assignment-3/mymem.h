@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdio.h>
 
 typedef enum strategies_enum
 {
@@ -24,7 +25,15 @@ int mem_total();
 int mem_largest_free();
 int mem_small_free(int size);
 char mem_is_alloc(void *ptr);
+int mem_block_size(void *ptr);
+void mem_set_large_threshold(size_t threshold);
+size_t mem_large_threshold();
+size_t mem_large_size(void *ptr);
+int mem_free_large(void *block);
+int mem_large_count();
+size_t mem_large_allocated();
 void* mem_pool();
 void print_memory();
 void print_memory_status();
+void fprint_memory_status(FILE *out);
 void try_mymem(int argc, char **argv);
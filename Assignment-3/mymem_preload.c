@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <malloc.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include "mymem.h"
+#include "memprof.h"
+
+/********************
+ * LD_PRELOAD interposition library for mymem.
+ *
+ * Build with "make preload" and run an unmodified program on the pool:
+ *   MYMEM_STRATEGY=best MYMEM_POOL_SIZE=67108864 LD_PRELOAD=./libmymem.so <program>
+ *
+ * MYMEM_STRATEGY  - best, worst, first or next (default first)
+ * MYMEM_POOL_SIZE - pool size in bytes (default 64MB)
+ * MYMEM_LARGE_THRESHOLD - requests of at least this many bytes get their own mapping (default off)
+ * MYMEM_PROF_RATE - if set, sample one pool allocation per this many bytes (see memprof.c)
+ * MYMEM_PROF_FILE - where profiles go (default mymem.prof.folded); written at exit and on MYMEM_PROF_SIGNAL
+ * MYMEM_PROF_SIGNAL - signal number that requests a profile (default SIGUSR2, 0 for none);
+ *                     skipped if the program already handles that signal
+ *
+ * Requests the pool cannot satisfy fall back to the system allocator, and so does
+ * everything if the pool itself cannot be allocated.
+ * A summary is printed to stderr when the program exits.
+ ********************/
+
+#define DEFAULT_POOL_SIZE (64 * 1024 * 1024)
+#define ALIGNMENT 16 //mymem hands out back-to-back blocks, so keep every size a multiple of this
+
+//glibc's own allocator, used for fallback and for mymem's bookkeeping
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int in_mymem __attribute__((tls_model("initial-exec")));//set while this thread is inside mymem
+static int initialized = 0;
+static int pool_disabled = 0;//initmem could not get a pool, everything goes to the system
+static strategies pool_strategy = NotSet;
+
+static char *pool_start = NULL;//bounds of the pool, used to tell our pointers from the system's
+static char *pool_end = NULL;
+static size_t (*real_usable_size)(void *) = NULL;
+static const char *prof_file = NULL;//set when the heap profiler is running
+static volatile int dump_in_progress = 0;//a snapshot is being written outside pool_lock
+static int report_fd = -1;//private copy of stderr, programs like ls close theirs before exiting
+
+static size_t large_threshold = 0;//copy of mem_large_threshold(), 0 when large mappings are off
+
+static unsigned long pool_allocs = 0;    //requests served from the pool
+static unsigned long large_allocs = 0;   //requests served by mymem's large mappings
+static unsigned long fallback_allocs = 0;//requests handed to the system allocator
+
+static void preload_report(void);
+
+/* fork() handlers: hold pool_lock across the fork so the child never inherits it
+ * locked by a thread that does not exist there.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void fork_child(void)
+{
+    pthread_mutex_init(&pool_lock, NULL);
+}
+
+/* Set up the pool from the environment.  Must be called with pool_lock held and in_mymem set,
+ * so the malloc calls made by initmem go to the system allocator.
+ */
+static void preload_init()
+{
+    char *env;
+    size_t size = DEFAULT_POOL_SIZE;
+    strategies strategy = First;
+
+    if((env = getenv("MYMEM_POOL_SIZE")) != NULL && atol(env) > 0) {
+        size = (size_t)atol(env);
+    }
+    if(size > INT_MAX) {//mymem keeps block sizes and totals in ints
+        fprintf(stderr, "mymem: MYMEM_POOL_SIZE %s is too large, using %d bytes\n", env, INT_MAX);
+        size = INT_MAX;
+    }
+    if((env = getenv("MYMEM_STRATEGY")) != NULL && strategyFromString(env) != NotSet) {
+        strategy = strategyFromString(env);
+    }
+
+    if((env = getenv("MYMEM_LARGE_THRESHOLD")) != NULL && atol(env) > 0) {
+        large_threshold = (size_t)atol(env);
+        mem_set_large_threshold(large_threshold);
+    }
+
+    pool_strategy = strategy;
+    initmem(strategy, size);
+    if(mem_pool() == NULL) {
+        fprintf(stderr, "mymem: could not allocate a %zu byte pool, using the system allocator\n", size);
+        pool_disabled = 1;
+        large_threshold = 0;//large mappings are part of the pool's accounting too
+        mem_set_large_threshold(0);
+    }
+    if((env = getenv("MYMEM_PROF_RATE")) != NULL) {
+        prof_file = getenv("MYMEM_PROF_FILE");
+        if(prof_file == NULL){ prof_file = "mymem.prof.folded"; }
+        memprof_start(atol(env));
+        env = getenv("MYMEM_PROF_SIGNAL");
+        if(env == NULL || atoi(env) > 0) {
+            memprof_dump_on_signal(env != NULL ? atoi(env) : SIGUSR2);
+        }
+    }
+    pool_start = mem_pool();
+    pool_end = pool_start + (pool_start != NULL ? size : 0);
+    real_usable_size = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+    report_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);//don't leak it into exec'd children
+    initialized = 1;
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    atexit(preload_report);
+}
+
+static int in_pool(void *ptr)
+{
+    return (char *)ptr >= pool_start && (char *)ptr < pool_end;
+}
+
+/* Whether ptr could have come from mymem, without taking the lock.
+ * Large mappings can be anywhere, so pointers outside the pool need a
+ * lookup under the lock once large mappings are on.
+ */
+static int may_be_ours(void *ptr)
+{
+    return in_pool(ptr) || large_threshold > 0;
+}
+
+/* Usable size of a block from mymem, 0 if ptr is not one.  Needs pool_lock. */
+static size_t our_size(void *ptr)
+{
+    return in_pool(ptr) ? (size_t)mem_block_size(ptr) : mem_large_size(ptr);
+}
+
+/* With pool_lock held: if a profile dump was requested, snapshot it and return 1.
+ * The caller writes it with write_dump once the lock is released.
+ */
+static int take_dump_request()
+{
+    if(prof_file == NULL || dump_in_progress || !memprof_dump_requested()){ return 0; }
+    memprof_snapshot();
+    dump_in_progress = 1;
+    return 1;
+}
+
+/* Without pool_lock: write the snapshot.  Symbolizing takes the loader's lock,
+ * which a thread in dlopen may hold while it waits for pool_lock in malloc.
+ */
+static int write_dump()
+{
+    int count;
+
+    in_mymem = 1;//stdio's and dladdr's allocations stay off the pool
+    count = memprof_dump_snapshot_file(prof_file);
+    in_mymem = 0;
+    dump_in_progress = 0;
+    return count;
+}
+
+/* Print the allocator summary at exit */
+static void preload_report(void)
+{
+    FILE *out;
+
+    pthread_mutex_lock(&pool_lock);
+    in_mymem = 1;
+    out = report_fd >= 0 ? fdopen(report_fd, "w") : NULL;
+    if(out != NULL && pool_disabled) {
+        fprintf(out, "\n=== mymem (no pool) ===\n%lu allocations went to the system allocator.\n",
+                fallback_allocs);
+    } else if(out != NULL) {
+        fprintf(out, "\n=== mymem (%s, %d byte pool) ===\n", strategy_name(pool_strategy), mem_total());
+        fprintf(out, "%lu allocations from the pool, %lu large mappings, %lu fell back to the system allocator.\n",
+                pool_allocs, large_allocs, fallback_allocs);
+        fprint_memory_status(out);
+    }
+    if(prof_file != NULL) {
+        memprof_snapshot();
+        dump_in_progress = 1;
+    }
+    in_mymem = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(prof_file != NULL) {
+        int count = write_dump();
+        if(out != NULL) {
+            fprintf(out, "Heap profile: %d call sites written to %s.\n", count, prof_file);
+        }
+    }
+    if(out != NULL) {
+        in_mymem = 1;
+        fclose(out);
+        in_mymem = 0;
+    }
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = NULL;
+    int dump;
+    size_t rounded = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if(in_mymem){ return __libc_malloc(size); }//mymem's own bookkeeping
+    if(size == 0){ rounded = ALIGNMENT; }      //malloc(0) still needs a unique pointer
+
+    pthread_mutex_lock(&pool_lock);
+    in_mymem = 1;
+    if(!initialized){ preload_init(); }
+    //no point searching for a block bigger than the pool, unless it goes to a large mapping
+    if(!pool_disabled &&
+       (rounded <= (size_t)mem_total() || (large_threshold > 0 && rounded >= large_threshold))) {
+        ptr = mymalloc(rounded);
+    }
+    if(ptr == NULL){ fallback_allocs++; }
+    else if(in_pool(ptr)){ pool_allocs++; }
+    else { large_allocs++; }
+    dump = take_dump_request();
+    in_mymem = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(dump){ write_dump(); }
+
+    if(ptr == NULL) {
+        ptr = __libc_malloc(size);//pool exhausted, let the system handle it
+    }
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    int dump, ours = 1;
+
+    if(ptr == NULL){ return; }
+    if(in_mymem || !may_be_ours(ptr)) {
+        __libc_free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    in_mymem = 1;
+    if(in_pool(ptr)){ myfree(ptr); }
+    else { ours = mem_free_large(ptr); }//a single lookup either frees it or tells us it is glibc's
+    dump = take_dump_request();
+    in_mymem = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(dump){ write_dump(); }
+    if(!ours){ __libc_free(ptr); }
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if(in_mymem){ return __libc_calloc(nmemb, size); }
+    if(size != 0 && nmemb > ((size_t)-1) / size) {//multiplication would overflow
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ptr = malloc(nmemb * size);
+    if(ptr != NULL) {
+        memset(ptr, 0, nmemb * size);//pool blocks get reused, so they are not zeroed for us
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *new_ptr;
+    size_t old_size;
+
+    if(in_mymem || (ptr != NULL && !may_be_ours(ptr))){ return __libc_realloc(ptr, size); }
+    if(ptr == NULL){ return malloc(size); }
+
+    pthread_mutex_lock(&pool_lock);
+    in_mymem = 1;
+    old_size = our_size(ptr);
+    in_mymem = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(old_size == 0 && !in_pool(ptr)){ return __libc_realloc(ptr, size); }//not a large mapping
+    if(size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    if(size <= old_size){ return ptr; }//block is already big enough
+
+    new_ptr = malloc(size);
+    if(new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size);
+        free(ptr);
+    }
+    return new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if(alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;//must be a power of two multiple of sizeof(void *)
+    }
+
+    //every pool block is ALIGNMENT aligned; anything stricter goes to the system
+    if(alignment <= ALIGNMENT && !in_mymem) {
+        ptr = malloc(size);
+    } else {
+        ptr = __libc_memalign(alignment, size);
+    }
+
+    if(ptr == NULL){ return ENOMEM; }
+    *memptr = ptr;
+    return 0;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    size_t size = 0;
+
+    if(ptr == NULL){ return 0; }
+    if(may_be_ours(ptr)) {
+        pthread_mutex_lock(&pool_lock);
+        in_mymem = 1;
+        size = our_size(ptr);
+        in_mymem = 0;
+        pthread_mutex_unlock(&pool_lock);
+        if(size > 0 || in_pool(ptr)){ return size; }
+    }
+    return real_usable_size != NULL ? real_usable_size(ptr) : 0;
+}